@@ -0,0 +1,129 @@
+/*
+ * Time creating a CPU-written scanout bo and writing its first full frame,
+ * with and without TEGRA_UDRM_GBM_PREFAULT.
+ *
+ * Usage: GBM_BACKEND=tegra-udrm dumb_first_frame [/dev/dri/cardN] [width height [iterations]]
+ *
+ * A fresh gbm device is created for every iteration so that the bo always
+ * comes from a new dumb buffer rather than from the device's recycle pool.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gbm.h>
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Returns the time for bo_create plus the first full write, or -1 */
+static double
+first_frame(int fd, uint32_t width, uint32_t height, double *create_us)
+{
+    struct gbm_device *gbm;
+    struct gbm_bo *bo;
+    uint32_t stride;
+    void *map_data = NULL;
+    uint8_t *map;
+    double start, created, end;
+
+    gbm = gbm_create_device(fd);
+    if (gbm == NULL)
+        return -1;
+
+    start = now_us();
+    bo = gbm_bo_create(gbm, width, height, GBM_FORMAT_XRGB8888,
+                       GBM_BO_USE_SCANOUT | GBM_BO_USE_WRITE);
+    created = now_us();
+    if (bo == NULL) {
+        gbm_device_destroy(gbm);
+        return -1;
+    }
+
+    map = gbm_bo_map(bo, 0, 0, width, height, GBM_BO_TRANSFER_WRITE,
+                     &stride, &map_data);
+    if (map == NULL) {
+        gbm_bo_destroy(bo);
+        gbm_device_destroy(gbm);
+        return -1;
+    }
+    for (uint32_t y = 0; y < height; y++)
+        memset(map + (size_t)y * stride, 0x80, (size_t)width * 4);
+    gbm_bo_unmap(bo, map_data);
+    end = now_us();
+
+    gbm_bo_destroy(bo);
+    gbm_device_destroy(gbm);
+
+    *create_us = created - start;
+    return end - start;
+}
+
+static int
+run(int fd, const char *prefault, uint32_t width, uint32_t height,
+    int iterations)
+{
+    double create_sum = 0, total_sum = 0, total_max = 0;
+
+    setenv("TEGRA_UDRM_GBM_PREFAULT", prefault, 1);
+
+    for (int i = 0; i < iterations; i++) {
+        double create_us;
+        double total_us = first_frame(fd, width, height, &create_us);
+
+        if (total_us < 0) {
+            fprintf(stderr, "iteration %d failed: %s\n", i, strerror(errno));
+            return -1;
+        }
+        create_sum += create_us;
+        total_sum += total_us;
+        if (total_us > total_max)
+            total_max = total_us;
+    }
+
+    printf("prefault=%s %ux%u: create %.0f us, create+first write %.0f us "
+           "(max %.0f us) over %d runs\n", prefault, width, height,
+           create_sum / iterations, total_sum / iterations, total_max,
+           iterations);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "/dev/dri/card0";
+    uint32_t width = argc > 3 ? strtoul(argv[2], NULL, 0) : 1920;
+    uint32_t height = argc > 3 ? strtoul(argv[3], NULL, 0) : 1080;
+    int iterations = argc > 4 ? atoi(argv[4]) : 50;
+    int fd;
+
+    if (iterations <= 0)
+        iterations = 1;
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if (run(fd, "0", width, height, iterations) < 0 ||
+        run(fd, "1", width, height, iterations) < 0) {
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Time what a minimal probing client pays to open a gbm device and query a
+ * format, in a fresh process each time.
+ *
+ * Usage: GBM_BACKEND=tegra-udrm probe_startup [/dev/dri/cardN [iterations]]
+ *
+ * Each iteration forks a child, which is timed from before the backend is
+ * loaded until gbm_device_is_format_supported() returns. The "preloaded" run
+ * loads libnvbufsurface and libnvbufsurftransform with RTLD_NOW first and
+ * counts that in the time, which is what a backend linked against them pays
+ * at load.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gbm.h>
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double
+probe(const char *path, bool preload)
+{
+    struct gbm_device *gbm;
+    double start = now_us();
+    int fd;
+
+    if (preload &&
+        (dlopen("libnvbufsurface.so.1.0.0", RTLD_NOW | RTLD_GLOBAL) == NULL ||
+         dlopen("libnvbufsurftransform.so.1.0.0", RTLD_NOW | RTLD_GLOBAL) == NULL)) {
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    gbm = gbm_create_device(fd);
+    if (gbm == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (!gbm_device_is_format_supported(gbm, GBM_FORMAT_XRGB8888,
+                                        GBM_BO_USE_RENDERING)) {
+        gbm_device_destroy(gbm);
+        close(fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return now_us() - start;
+}
+
+/* Run probe() in a child so nothing stays loaded between iterations */
+static double
+probe_in_child(const char *path, bool preload)
+{
+    double result = -1;
+    int status;
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) < 0)
+        return -1;
+
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        double us;
+
+        close(fds[0]);
+        us = probe(path, preload);
+        if (us < 0)
+            fprintf(stderr, "probe failed: %s\n", strerror(errno));
+        if (write(fds[1], &us, sizeof us) != sizeof us)
+            _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &result, sizeof result) != sizeof result)
+        result = -1;
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    return result;
+}
+
+static int
+run(const char *path, bool preload, int iterations)
+{
+    double sum = 0, min = 0, max = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        double us = probe_in_child(path, preload);
+
+        if (us < 0)
+            return -1;
+        sum += us;
+        if (i == 0 || us < min)
+            min = us;
+        if (us > max)
+            max = us;
+    }
+
+    printf("%-9s: create+probe %.0f us avg, %.0f us min, %.0f us max "
+           "over %d runs\n", preload ? "preloaded" : "lazy", sum / iterations,
+           min, max, iterations);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "/dev/dri/card0";
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+
+    if (iterations <= 0)
+        iterations = 1;
+
+    if (run(path, false, iterations) < 0 || run(path, true, iterations) < 0)
+        return 1;
+
+    return 0;
+}
@@ -36,13 +36,19 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
 
 #include <xf86drm.h>
+#include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
-#include <nvbufsurface.h>
-
 #include "gbm.h"
+#include "tegra_udrm_gbm.h"
 #include "tegra_udrm_gbm_int.h"
 
 static uint32_t
@@ -82,6 +88,13 @@ gbm_tudrm_get_format_modifier_plane_count(struct gbm_device *gbm,
     return 1;
 }
 
+static int
+gbm_tudrm_dmabuf_sync(int fd, uint64_t flags);
+static int
+gbm_tudrm_handle_export(struct gbm_tudrm_device *dri, uint32_t handle);
+static int
+gbm_tudrm_bo_ensure_handle(struct gbm_tudrm_device *dri, struct gbm_tudrm_bo *bo);
+
 static int
 gbm_tudrm_bo_write(struct gbm_bo *_bo, const void *buf, size_t count)
 {
@@ -89,21 +102,48 @@ gbm_tudrm_bo_write(struct gbm_bo *_bo, const void *buf, size_t count)
 
     // TODO: for bo->data.surface: Raw2NvBufSurface
 
-    if (bo->data.dmabuf_fd != NULL) {
+    if (bo->data.map == NULL || count > bo->data.size) {
         errno = EINVAL;
         return -1;
     }
 
+    if (bo->data.heap)
+        gbm_tudrm_dmabuf_sync(bo->data.dmabuf_fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
     memcpy(bo->data.map, buf, count);
+    if (bo->data.heap)
+        gbm_tudrm_dmabuf_sync(bo->data.dmabuf_fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
 
     return 0;
 }
 
+/* The returned fd belongs to the caller */
 static int
 gbm_tudrm_bo_get_fd(struct gbm_bo *_bo)
 {
+    struct gbm_tudrm_device *dri = gbm_tudrm_device(_bo->gbm);
     struct gbm_tudrm_bo *bo = gbm_tudrm_bo(_bo);
-    return bo->data.dmabuf_fd;
+
+    /* Never hand the memory to another bo_create once it's shared */
+    bo->data.exported = true;
+
+    if (bo->data.dmabuf_fd >= 0)
+        return fcntl(bo->data.dmabuf_fd, F_DUPFD_CLOEXEC, 0);
+
+    if (bo->base.v0.handle.u32)
+        return gbm_tudrm_handle_export(dri, bo->base.v0.handle.u32);
+
+    errno = EINVAL;
+    return -1;
+}
+
+static int
+gbm_tudrm_bo_get_plane_fd(struct gbm_bo *_bo, int plane)
+{
+    if (plane != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return gbm_tudrm_bo_get_fd(_bo);
 }
 
 static int
@@ -117,6 +157,10 @@ static union gbm_bo_handle
 gbm_tudrm_bo_get_handle_for_plane(struct gbm_bo *_bo, int plane)
 {
     struct gbm_tudrm_bo *bo = gbm_tudrm_bo(_bo);
+
+    /* Retry a dma-heap import that failed at allocation. On failure the
+     * handle stays 0, which is never a valid GEM handle. */
+    gbm_tudrm_bo_ensure_handle(gbm_tudrm_device(_bo->gbm), bo);
     return bo->base.v0.handle;
 }
 
@@ -141,6 +185,196 @@ gbm_tudrm_bo_get_modifier(struct gbm_bo *_bo)
     return bo->data.modifier;
 }
 
+/* Find or add the table entry of handle. Called with dri->lock held. */
+static struct gbm_tudrm_handle_ref *
+gbm_tudrm_handle_ref_locked(struct gbm_tudrm_device *dri, uint32_t handle)
+{
+    struct gbm_tudrm_handle_ref *ref;
+
+    for (unsigned i = 0; i < dri->handle_count; i++) {
+        if (dri->handles[i].handle == handle)
+            return &dri->handles[i];
+    }
+
+    if (dri->handle_count == dri->handle_alloc) {
+        unsigned alloc = dri->handle_alloc ? dri->handle_alloc * 2 : 16;
+        void *handles = realloc(dri->handles, alloc * sizeof(*dri->handles));
+        if (handles == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        dri->handles = handles;
+        dri->handle_alloc = alloc;
+    }
+    ref = &dri->handles[dri->handle_count++];
+    ref->handle = handle;
+    ref->refs = 0;
+    ref->fd = -1;
+    ref->fbs = NULL;
+    return ref;
+}
+
+/* Import a dma-buf into the DRM device and take a reference on its handle */
+static int
+gbm_tudrm_handle_import(struct gbm_tudrm_device *dri, int fd, uint32_t *handle)
+{
+    struct gbm_tudrm_handle_ref *ref;
+    int ret;
+
+    /* Under the lock, so the handle can't be closed by a concurrent
+     * gbm_tudrm_handle_close() between the import and taking the ref */
+    pthread_mutex_lock(&dri->lock);
+    TRACE_BEGIN("drmPrimeFDToHandle fd=%d", fd);
+    ret = drmPrimeFDToHandle(dri->base.v0.fd, fd, handle);
+    TRACE_END();
+    if (ret < 0) {
+        pthread_mutex_unlock(&dri->lock);
+        return ret;
+    }
+
+    ref = gbm_tudrm_handle_ref_locked(dri, *handle);
+    if (ref == NULL) {
+        /* not in the table, so nobody else holds it */
+        struct drm_gem_close close_arg = { .handle = *handle };
+        drmIoctl(dri->base.v0.fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+        pthread_mutex_unlock(&dri->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    ref->refs++;
+    pthread_mutex_unlock(&dri->lock);
+
+    return 0;
+}
+
+/* Take the first reference on a handle created by this device, e.g. of a
+ * dumb buffer, so that importing its exported dma-buf shares it */
+static int
+gbm_tudrm_handle_adopt(struct gbm_tudrm_device *dri, uint32_t handle)
+{
+    struct gbm_tudrm_handle_ref *ref;
+
+    pthread_mutex_lock(&dri->lock);
+    ref = gbm_tudrm_handle_ref_locked(dri, handle);
+    if (ref)
+        ref->refs++;
+    pthread_mutex_unlock(&dri->lock);
+
+    return ref ? 0 : -1;
+}
+
+static void
+gbm_tudrm_fb_free_list(struct gbm_tudrm_device *dri, struct gbm_tudrm_fb *fb)
+{
+    while (fb) {
+        struct gbm_tudrm_fb *next = fb->next;
+        drmModeRmFB(dri->base.v0.fd, fb->fb_id);
+        free(fb);
+        fb = next;
+    }
+}
+
+/* Drop a reference taken by gbm_tudrm_handle_import(), closing the GEM
+ * handle and removing its framebuffers with the last one */
+static void
+gbm_tudrm_handle_close(struct gbm_tudrm_device *dri, uint32_t handle)
+{
+    struct gbm_tudrm_fb *fbs = NULL;
+    int fd = -1;
+
+    pthread_mutex_lock(&dri->lock);
+    for (unsigned i = 0; i < dri->handle_count; i++) {
+        if (dri->handles[i].handle != handle)
+            continue;
+        if (--dri->handles[i].refs == 0) {
+            struct drm_gem_close close_arg;
+
+            fd = dri->handles[i].fd;
+            fbs = dri->handles[i].fbs;
+            dri->handles[i] = dri->handles[--dri->handle_count];
+
+            /* Still under the lock, otherwise a concurrent import of the
+             * same dma-buf could get this handle back and lose it here.
+             * The framebuffers hold their own reference on the object. */
+            memset(&close_arg, 0, sizeof close_arg);
+            close_arg.handle = handle;
+            drmIoctl(dri->base.v0.fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&dri->lock);
+
+    gbm_tudrm_fb_free_list(dri, fbs);
+    if (fd >= 0)
+        close(fd);
+}
+
+/* Return a new fd for the dma-buf behind an imported handle. The first call
+ * exports it, later ones only dup the shared fd. */
+static int
+gbm_tudrm_handle_export(struct gbm_tudrm_device *dri, uint32_t handle)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&dri->lock);
+    for (unsigned i = 0; i < dri->handle_count; i++) {
+        struct gbm_tudrm_handle_ref *ref = &dri->handles[i];
+        if (ref->handle != handle)
+            continue;
+        if (ref->fd < 0 &&
+            drmPrimeHandleToFD(dri->base.v0.fd, handle, DRM_CLOEXEC | DRM_RDWR, &ref->fd) < 0)
+            ref->fd = -1;
+        if (ref->fd >= 0)
+            fd = fcntl(ref->fd, F_DUPFD_CLOEXEC, 0);
+        break;
+    }
+    pthread_mutex_unlock(&dri->lock);
+
+    return fd;
+}
+
+/* Bracket CPU access to a cached dma-buf mapping */
+static int
+gbm_tudrm_dmabuf_sync(int fd, uint64_t flags)
+{
+    struct dma_buf_sync sync = { .flags = flags };
+    int ret;
+
+    do {
+        ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    return ret;
+}
+
+static uint64_t
+gbm_tudrm_dmabuf_sync_flags(uint32_t transfer_flags)
+{
+    uint64_t flags = 0;
+
+    if (transfer_flags & GBM_BO_TRANSFER_READ)
+        flags |= DMA_BUF_SYNC_READ;
+    if (transfer_flags & GBM_BO_TRANSFER_WRITE)
+        flags |= DMA_BUF_SYNC_WRITE;
+    return flags;
+}
+
+/* Import a dma-heap buffer into DRM if that hasn't succeeded yet */
+static int
+gbm_tudrm_bo_ensure_handle(struct gbm_tudrm_device *dri, struct gbm_tudrm_bo *bo)
+{
+    uint32_t handle;
+
+    if (bo->base.v0.handle.u32 || !bo->data.heap)
+        return 0;
+
+    if (gbm_tudrm_handle_import(dri, bo->data.dmabuf_fd, &handle) < 0)
+        return -1;
+
+    bo->base.v0.handle.u32 = handle;
+    return 0;
+}
+
 static struct gbm_bo *
 gbm_tudrm_bo_import(struct gbm_device *gbm,
                   uint32_t type, void *buffer, uint32_t usage)
@@ -156,6 +390,9 @@ gbm_tudrm_bo_import(struct gbm_device *gbm,
     }
 
     bo->base.gbm = gbm;
+    /* The caller keeps its fd, only the GEM handle is held. bo_get_fd
+     * re-exports the dma-buf from it. */
+    bo->data.dmabuf_fd = -1;
 
     if (type == GBM_BO_IMPORT_FD_MODIFIER) {
         int ret;
@@ -173,7 +410,7 @@ gbm_tudrm_bo_import(struct gbm_device *gbm,
         uint32_t handle = 0;
 
         // TODO: more than one plane?
-        ret = drmPrimeFDToHandle(dri->base.v0.fd, dmabuf_fd, &handle);
+        ret = gbm_tudrm_handle_import(dri, dmabuf_fd, &handle);
         if (ret < 0) {
             goto fail;
         }
@@ -183,7 +420,6 @@ gbm_tudrm_bo_import(struct gbm_device *gbm,
         bo->base.v0.height = fd_data->height;
         bo->base.v0.format = format_canonicalize(fd_data->format);
         bo->base.v0.stride = fd_data->strides[0];
-        bo->data.dmabuf_fd = fd_data->fds[0];
         bo->data.modifier = fd_data->modifier;
 
     } else if (type == GBM_BO_IMPORT_FD) {
@@ -194,7 +430,7 @@ gbm_tudrm_bo_import(struct gbm_device *gbm,
         int dmabuf_fd = fd_data->fd;
         uint32_t handle = 0;
 
-        ret = drmPrimeFDToHandle(dri->base.v0.fd, dmabuf_fd, &handle);
+        ret = gbm_tudrm_handle_import(dri, dmabuf_fd, &handle);
         if (ret < 0) {
             goto fail;
         }
@@ -204,11 +440,11 @@ gbm_tudrm_bo_import(struct gbm_device *gbm,
         bo->base.v0.height = fd_data->height;
         bo->base.v0.format = format_canonicalize(fd_data->format);
         bo->base.v0.stride = fd_data->stride;
-        bo->data.dmabuf_fd = fd_data->fd;
 
     } else {
         // TODO: maybe GBM_BO_IMPORT_EGL_IMAGE
-        // or GBM_BO_IMPORT_WL_BUFFER?
+        // or GBM_BO_IMPORT_WL_BUFFER? wl_shm buffers can be
+        // wrapped with gbm_tudrm_bo_import_shm().
         goto fail;
     }
 
@@ -219,6 +455,20 @@ fail:
     return NULL;
 }
 
+/* Take the page faults of a fresh mapping now instead of on the first frame.
+ * DRM and dma-buf mmaps are VM_PFNMAP, which MAP_POPULATE and MADV_WILLNEED
+ * skip, so touch every page instead. Writing back what was read keeps the
+ * contents and makes the fault a write fault, so no second one follows. */
+static void
+gbm_tudrm_prefault(void *map, size_t size)
+{
+    volatile uint8_t *p = map;
+    size_t page = getpagesize();
+
+    for (size_t off = 0; off < size; off += page)
+        p[off] = p[off];
+}
+
 static inline void *
 gbm_tudrm_bo_map_dumb(struct gbm_tudrm_device *dri, struct gbm_tudrm_bo *bo)
 {
@@ -235,25 +485,322 @@ gbm_tudrm_bo_map_dumb(struct gbm_tudrm_device *dri, struct gbm_tudrm_bo *bo)
    if (ret)
       return NULL;
 
-   bo->data.map = mmap(NULL, bo->data.size, PROT_WRITE,
+   /* Readable as well, so clients can blend into the buffer */
+   bo->data.map = mmap(NULL, bo->data.size, PROT_READ | PROT_WRITE,
                   MAP_SHARED, dri->base.v0.fd, map_arg.offset);
    if (bo->data.map == MAP_FAILED) {
       bo->data.map = NULL;
       return NULL;
    }
 
+   if (dri->prefault)
+      gbm_tudrm_prefault(bo->data.map, bo->data.size);
+
    return bo->data.map;
 }
 
-static struct gbm_bo *
-gbm_tudrm_bo_create(struct gbm_device *gbm,
-                  uint32_t width, uint32_t height,
-                  uint32_t format, uint32_t usage,
-                  const uint64_t *_modifiers,
-                  const unsigned int count)
+/* Whether a CPU-written buffer can come from a dma-heap instead of a dumb
+ * buffer. The heap is opened on first use. */
+static bool
+gbm_tudrm_use_heap(struct gbm_tudrm_device *dri, uint32_t usage)
+{
+    if (usage & (GBM_BO_USE_SCANOUT | GBM_BO_USE_CURSOR))
+        return false;
+
+    pthread_mutex_lock(&dri->lock);
+    if (!dri->heap_probed) {
+        const char *heap = getenv("TEGRA_UDRM_GBM_DMA_HEAP");
+        char path[PATH_MAX];
+
+        if (heap == NULL)
+            heap = "system";
+        if (heap[0] != '\0' && strcmp(heap, "0") != 0) {
+            snprintf(path, sizeof path, "/dev/dma_heap/%s", heap);
+            dri->heap_fd = open(path, O_RDWR | O_CLOEXEC);
+        }
+        dri->heap_probed = true;
+    }
+    pthread_mutex_unlock(&dri->lock);
+
+    return dri->heap_fd >= 0;
+}
+
+static int
+gbm_tudrm_bo_alloc_heap(struct gbm_tudrm_device *dri, struct gbm_tudrm_bo *bo)
+{
+    struct dma_heap_allocation_data alloc;
+    uint32_t stride = ALIGN(bo->base.v0.width * 4, 64);
+
+    memset(&alloc, 0, sizeof alloc);
+    alloc.len = PAGE_ALIGN((uint64_t)stride * bo->base.v0.height);
+    alloc.fd_flags = O_RDWR | O_CLOEXEC;
+
+    if (alloc.len > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ioctl(dri->heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc) < 0)
+        return -1;
+
+    bo->data.heap = true;
+    bo->data.dmabuf_fd = alloc.fd;
+    bo->data.size = alloc.len;
+    bo->base.v0.stride = stride;
+
+    bo->data.map = mmap(NULL, bo->data.size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, alloc.fd, 0);
+    if (bo->data.map == MAP_FAILED) {
+        bo->data.map = NULL;
+        return -1;
+    }
+
+    /* The mapping is cached, bracket the touches like any other CPU access
+     * so no dirty lines are left behind */
+    if (dri->prefault &&
+        gbm_tudrm_dmabuf_sync(alloc.fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW) == 0) {
+        gbm_tudrm_prefault(bo->data.map, bo->data.size);
+        gbm_tudrm_dmabuf_sync(alloc.fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
+    }
+
+    /* libgbm reads v0.handle directly, so import right away. Only if the
+     * device can't import it (e.g. no display behind the fd) is that left
+     * to get_handle and get_fb_id, which retry. */
+    gbm_tudrm_bo_ensure_handle(dri, bo);
+
+    return 0;
+}
+
+static int
+gbm_tudrm_surface_map(NvBufSurface *surf, NvBufSurfaceMemMapFlags flags)
+{
+    int ret;
+
+    TRACE_BEGIN("NvBufSurfaceMap %ux%u", surf->surfaceList[0].width,
+                surf->surfaceList[0].height);
+    ret = nvbuf.NvBufSurfaceMap(surf, 0, 0, flags);
+    TRACE_END();
+    return ret;
+}
+
+static int
+gbm_tudrm_surface_unmap(NvBufSurface *surf)
+{
+    int ret;
+
+    TRACE_BEGIN("NvBufSurfaceUnMap %ux%u", surf->surfaceList[0].width,
+                surf->surfaceList[0].height);
+    ret = nvbuf.NvBufSurfaceUnMap(surf, 0, 0);
+    TRACE_END();
+    return ret;
+}
+
+static NvBufSurfaceColorFormat
+format_to_nvbuf(uint32_t format)
+{
+    switch(format_canonicalize(format)) {
+    case GBM_FORMAT_ARGB8888:
+        return NVBUF_COLOR_FORMAT_ARGB;
+    case GBM_FORMAT_XRGB8888:
+        return NVBUF_COLOR_FORMAT_xRGB;
+    case GBM_FORMAT_ABGR8888:
+        return NVBUF_COLOR_FORMAT_ABGR;
+    case GBM_FORMAT_XBGR8888:
+        return NVBUF_COLOR_FORMAT_xBGR;
+    default:
+        return NVBUF_COLOR_FORMAT_INVALID;
+    }
+}
+
+/* Allocate the NvBufSurface backing bo and import it into the DRM device.
+ * Size and format are taken from bo->base.v0. */
+static int
+gbm_tudrm_bo_alloc_surface(struct gbm_tudrm_device *dri, struct gbm_tudrm_bo *bo,
+                           NvBufSurfaceLayout layout, uint32_t usage)
+{
+    int ret;
+    NvBufSurfaceAllocateParams args;
+
+    if (!gbm_tudrm_nvbuf_load())
+        return -1;
+
+    memset(&args, 0, sizeof(args));
+
+    args.params.width = bo->base.v0.width;
+    args.params.height = bo->base.v0.height;
+    args.params.memType = NVBUF_MEM_SURFACE_ARRAY;
+    args.params.layout = layout;
+    args.params.colorFormat = format_to_nvbuf(bo->base.v0.format);
+    if (args.params.colorFormat == NVBUF_COLOR_FORMAT_INVALID) {
+        errno = EINVAL;
+        return -1;
+    }
+    args.memtag = ((usage & GBM_BO_USE_PROTECTED) ? NvBufSurfaceTag_PROTECTED : NvBufSurfaceTag_NONE);
+
+    TRACE_BEGIN("NvBufSurfaceAllocate %ux%u " FOURCC_FMT " %s",
+                bo->base.v0.width, bo->base.v0.height,
+                FOURCC_ARGS(bo->base.v0.format),
+                layout == NVBUF_LAYOUT_PITCH ? "pitch" : "block-linear");
+    ret = nvbuf.NvBufSurfaceAllocate(&bo->data.surface, 1, &args);
+    TRACE_END();
+    if (ret < 0) {
+        bo->data.surface = NULL;
+        return -1;
+    }
+
+    NvBufSurfaceParams *params = &bo->data.surface->surfaceList[0];
+
+    int fd = params->bufferDesc;
+    int pitch = params->planeParams.pitch[0];
+    uint32_t handle = 0;
+
+    ret = gbm_tudrm_handle_import(dri, fd, &handle);
+    if (ret < 0) {
+        return -1;
+    }
+
+    bo->base.v0.handle.u32 = handle;
+    bo->base.v0.stride = pitch;
+    bo->data.dmabuf_fd = fd;
+    return 0;
+}
+
+/* Free everything backing a bo, including the bo itself */
+static void
+gbm_tudrm_bo_release(struct gbm_tudrm_device *dri, struct gbm_tudrm_bo *bo)
+{
+    free(bo->data.shm);
+    if (bo->data.surface) {
+        if (bo->data.surface->surfaceList[0].mappedAddr.addr[0])
+            gbm_tudrm_surface_unmap(bo->data.surface);
+        nvbuf.NvBufSurfaceDestroy(bo->data.surface);
+    }
+    if (bo->data.map)
+        munmap(bo->data.map, bo->data.size);
+
+    /* Dumb buffers too, GEM_CLOSE of their last handle is what
+     * DRM_IOCTL_MODE_DESTROY_DUMB does */
+    if (bo->base.v0.handle.u32)
+        gbm_tudrm_handle_close(dri, bo->base.v0.handle.u32);
+
+    if (bo->data.heap)
+        close(bo->data.dmabuf_fd);
+
+    free(bo);
+}
+
+static bool
+modifier_is_block_linear(uint64_t modifier)
+{
+    // compressed buffers don't render correctly when imported
+    return modifier != DRM_FORMAT_MOD_LINEAR &&
+        !(modifier & ~DRM_FORMAT_MOD_NVIDIA_BLOCK_LINEAR_2D(0x0, 0x1, 0x3, 0xff, 0xf));
+}
+
+/* Choose the NvBufSurface layout for a bo and the modifier describing it.
+ * Without a modifier list the modifier is implicit for block-linear bos. */
+static int
+gbm_tudrm_pick_layout(struct gbm_tudrm_device *dri, uint32_t usage,
+                      const uint64_t *modifiers, unsigned int count,
+                      NvBufSurfaceLayout *layout, uint64_t *modifier)
+{
+    bool linear_ok = true, need_linear = false, want_linear = false;
+    const uint64_t *block_linear = NULL;
+
+    if (modifiers && count) {
+        linear_ok = false;
+        for (unsigned int i = 0; i < count; i++) {
+            if (modifiers[i] == DRM_FORMAT_MOD_LINEAR)
+                linear_ok = true;
+            else if (!block_linear && modifier_is_block_linear(modifiers[i]))
+                block_linear = &modifiers[i];
+        }
+        if (!linear_ok && !block_linear) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    /* Before ABI version 1 the loader passed usage = 0 along with
+     * modifiers, so only the modifier list can be trusted then. Cursors,
+     * front buffers and explicitly linear bos have to be pitch-linear,
+     * scanout only prefers it since planes can scan out block-linear
+     * modifiers they advertise. */
+    if (!(modifiers && count && dri->base.v0.backend_version < 1)) {
+        need_linear = usage & (GBM_BO_USE_LINEAR | GBM_BO_USE_CURSOR |
+                               GBM_BO_USE_FRONT_RENDERING);
+        want_linear = need_linear || (usage & GBM_BO_USE_SCANOUT);
+    }
+
+    if ((want_linear || (modifiers && count && !block_linear)) && linear_ok) {
+        *layout = NVBUF_LAYOUT_PITCH;
+        *modifier = DRM_FORMAT_MOD_LINEAR;
+    } else if (need_linear) {
+        /* e.g. a cursor but the list only allows tiling */
+        errno = EINVAL;
+        return -1;
+    } else {
+        *layout = NVBUF_LAYOUT_BLOCK_LINEAR;
+        *modifier = block_linear ? *block_linear : DRM_FORMAT_MOD_INVALID;
+    }
+
+    return 0;
+}
+
+/* Find an idle bo created with the same parameters */
+static struct gbm_tudrm_bo *
+gbm_tudrm_recycle_take(struct gbm_tudrm_device *dri,
+                       uint32_t width, uint32_t height,
+                       uint32_t format, uint32_t usage,
+                       uint64_t modifier)
+{
+    struct gbm_tudrm_bo *bo = NULL;
+
+    pthread_mutex_lock(&dri->lock);
+    for (unsigned i = dri->recycle_count; i-- > 0; ) {
+        struct gbm_tudrm_bo *cur = dri->recycle[i];
+        if (cur->base.v0.width == width && cur->base.v0.height == height &&
+            cur->base.v0.format == format && cur->data.usage == usage &&
+            cur->data.modifier == modifier) {
+            bo = cur;
+            memmove(&dri->recycle[i], &dri->recycle[i + 1],
+                    (dri->recycle_count - i - 1) * sizeof(dri->recycle[0]));
+            dri->recycle_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dri->lock);
+
+    return bo;
+}
+
+/* Put a bo into the recycle pool, evicting the oldest one if full */
+static void
+gbm_tudrm_recycle_put(struct gbm_tudrm_device *dri, struct gbm_tudrm_bo *bo)
+{
+    struct gbm_tudrm_bo *evicted = NULL;
+
+    pthread_mutex_lock(&dri->lock);
+    if (dri->recycle_count == RECYCLE_POOL_MAX) {
+        evicted = dri->recycle[0];
+        memmove(&dri->recycle[0], &dri->recycle[1],
+                (RECYCLE_POOL_MAX - 1) * sizeof(dri->recycle[0]));
+        dri->recycle_count--;
+    }
+    dri->recycle[dri->recycle_count++] = bo;
+    pthread_mutex_unlock(&dri->lock);
+
+    if (evicted)
+        gbm_tudrm_bo_release(dri, evicted);
+}
+
+/* Allocate a new bo, bypassing the recycle pool */
+static struct gbm_tudrm_bo *
+gbm_tudrm_bo_alloc(struct gbm_tudrm_device *dri,
+                   const struct gbm_tudrm_alloc_key *key)
 {
-    struct gbm_tudrm_device *dri = gbm_tudrm_device(gbm);
     struct gbm_tudrm_bo *bo;
+    uint32_t usage = key->usage;
 
     bo = calloc(1, sizeof *bo);
     if (bo == NULL) {
@@ -261,114 +808,353 @@ gbm_tudrm_bo_create(struct gbm_device *gbm,
         return NULL;
     }
 
-    bo->base.gbm = gbm;
-    bo->base.v0.width = width;
-    bo->base.v0.height = height;
-    bo->base.v0.format = format_canonicalize(format);
-    bo->data.modifier = (count && _modifiers) ? _modifiers[0] : 0;
+    bo->base.gbm = &dri->base;
+    bo->data.dmabuf_fd = -1;
+    bo->base.v0.width = key->width;
+    bo->base.v0.height = key->height;
+    bo->base.v0.format = key->format;
+    bo->data.modifier = key->modifier;
+    bo->data.usage = usage;
+    bo->data.recyclable = true;
+
+    if ((usage & GBM_BO_USE_WRITE) && gbm_tudrm_use_heap(dri, usage)) {
+        if (gbm_tudrm_bo_alloc_heap(dri, bo) < 0) {
+            goto fail;
+        }
 
-    if (usage & GBM_BO_USE_WRITE) {
+    } else if (usage & GBM_BO_USE_WRITE) {
         struct drm_mode_create_dumb create_arg;
         int ret;
 
         memset(&create_arg, 0, sizeof(create_arg));
         create_arg.bpp = 32;
-        create_arg.width = width;
-        create_arg.height = height;
+        create_arg.width = key->width;
+        create_arg.height = key->height;
 
+        TRACE_BEGIN("DRM_IOCTL_MODE_CREATE_DUMB %ux%u", key->width, key->height);
         ret = drmIoctl(dri->base.v0.fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg);
+        TRACE_END();
         if (ret) {
             goto fail;
         }
 
+        if (gbm_tudrm_handle_adopt(dri, create_arg.handle) < 0) {
+            struct drm_mode_destroy_dumb destroy_arg;
+            memset(&destroy_arg, 0, sizeof destroy_arg);
+            destroy_arg.handle = create_arg.handle;
+            drmIoctl(dri->base.v0.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
+            goto fail;
+        }
+
         bo->base.v0.stride = create_arg.pitch;
-        bo->base.v0.format = format;
         bo->base.v0.handle.u32 = create_arg.handle;
         bo->data.handle = create_arg.handle;
         bo->data.size = create_arg.size;
 
         if (gbm_tudrm_bo_map_dumb(dri, bo) == NULL) {
-            struct drm_mode_destroy_dumb destroy_arg;
-            memset(&destroy_arg, 0, sizeof destroy_arg);
-            destroy_arg.handle = create_arg.handle;
-            drmIoctl(dri->base.v0.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
+            goto fail;
         }
 
     } else {
-        int ret;
-        NvBufSurfaceAllocateParams args;
-
         /*
         TODO: what to do with these cases:
 
         GBM_BO_USE_RENDERING
-        GBM_BO_USE_FRONT_RENDERING
         */
 
-        memset(&args, 0, sizeof(args));
-
-        args.params.width = width;
-        args.params.height = height;
-        args.params.memType = NVBUF_MEM_SURFACE_ARRAY;
-        if (usage & (GBM_BO_USE_LINEAR | GBM_BO_USE_SCANOUT | GBM_BO_USE_CURSOR))
-            args.params.layout = NVBUF_LAYOUT_PITCH;
-        else
-            args.params.layout = NVBUF_LAYOUT_BLOCK_LINEAR;
-        switch(format_canonicalize(format)) {
-        case GBM_FORMAT_ARGB8888:
-            args.params.colorFormat = NVBUF_COLOR_FORMAT_ARGB;
-            break;
-        case GBM_FORMAT_XRGB8888:
-            args.params.colorFormat = NVBUF_COLOR_FORMAT_xRGB;
-            break;
-        case GBM_FORMAT_ABGR8888:
-            args.params.colorFormat = NVBUF_COLOR_FORMAT_ABGR;
-            break;
-        case GBM_FORMAT_XBGR8888:
-            args.params.colorFormat = NVBUF_COLOR_FORMAT_xBGR;
-            break;
-        default:
+        if (gbm_tudrm_bo_alloc_surface(dri, bo, key->layout, usage) < 0) {
             goto fail;
         }
-        args.memtag = ((usage & GBM_BO_USE_PROTECTED) ? NvBufSurfaceTag_PROTECTED : NvBufSurfaceTag_NONE);
 
-        ret = NvBufSurfaceAllocate(&bo->data.surface, 1, &args);
-        if (ret < 0) {
+        /* Front buffers are written while being scanned out, map them
+         * right away so CPU access never has to wait for a mapping */
+        if ((usage & GBM_BO_USE_FRONT_RENDERING) &&
+            gbm_tudrm_surface_map(bo->data.surface, NVBUF_MAP_READ_WRITE) < 0) {
             goto fail;
         }
+    }
 
-        NvBufSurfaceParams *params = &bo->data.surface->surfaceList[0];
+    return bo;
 
-        int fd = params->bufferDesc;
-        int pitch = params->planeParams.pitch[0];
-        uint32_t handle = 0;
+fail:
+    gbm_tudrm_bo_release(dri, bo);
+    return NULL;
+}
 
-        ret = drmPrimeFDToHandle(dri->base.v0.fd, fd, &handle);
-        if (ret < 0) {
-            goto fail;
-        }
+static struct gbm_bo *
+gbm_tudrm_bo_create(struct gbm_device *gbm,
+                  uint32_t width, uint32_t height,
+                  uint32_t format, uint32_t usage,
+                  const uint64_t *_modifiers,
+                  const unsigned int count)
+{
+    struct gbm_tudrm_device *dri = gbm_tudrm_device(gbm);
+    struct gbm_tudrm_bo *bo;
+    struct gbm_tudrm_alloc_key key = {
+        .width = width,
+        .height = height,
+        .format = format_canonicalize(format),
+        .usage = usage,
+        .modifier = DRM_FORMAT_MOD_LINEAR,
+        .layout = NVBUF_LAYOUT_PITCH,
+    };
+
+    if (!(usage & GBM_BO_USE_WRITE) &&
+        gbm_tudrm_pick_layout(dri, usage, _modifiers, count, &key.layout, &key.modifier) < 0)
+        return NULL;
 
-        bo->base.v0.handle.u32 = handle;
-        bo->base.v0.stride = pitch;
-        bo->data.dmabuf_fd = fd;
+    bo = gbm_tudrm_recycle_take(dri, key.width, key.height, key.format,
+                                key.usage, key.modifier);
+
+    pthread_mutex_lock(&dri->lock);
+    dri->history[dri->history_next] = key;
+    dri->history_next = (dri->history_next + 1) % ALLOC_HISTORY_MAX;
+    if (dri->history_count < ALLOC_HISTORY_MAX)
+        dri->history_count++;
+    if (bo) {
+        dri->stats.hits++;
+        if (bo->data.prewarmed)
+            dri->stats.prewarm_hits++;
+    } else {
+        dri->stats.misses++;
     }
+    pthread_mutex_unlock(&dri->lock);
 
-    return &bo->base;
+    if (bo) {
+        bo->data.prewarmed = false;
+        return &bo->base;
+    }
 
-fail:
-    if (bo->data.surface)
-        NvBufSurfaceDestroy(bo->data.surface);
-    free(bo);
-    return NULL;
+    bo = gbm_tudrm_bo_alloc(dri, &key);
+    return bo ? &bo->base : NULL;
 }
 
 static void
 gbm_tudrm_bo_destroy(struct gbm_bo *_bo)
 {
+    struct gbm_tudrm_device *dri = gbm_tudrm_device(_bo->gbm);
     struct gbm_tudrm_bo *bo = gbm_tudrm_bo(_bo);
-    if (bo->data.surface)
-        NvBufSurfaceDestroy(bo->data.surface);
-    free(bo);
+
+    if (!bo->data.recyclable || bo->data.exported) {
+        gbm_tudrm_bo_release(dri, bo);
+        return;
+    }
+
+    /* Keep the buffer, its handle and any mapping around for the next
+     * bo_create with the same parameters. The user data was already
+     * destroyed by the loader. */
+    bo->base.v0.user_data = NULL;
+    bo->base.v0.destroy_user_data = NULL;
+
+    gbm_tudrm_recycle_put(dri, bo);
+}
+
+static void *
+gbm_tudrm_prewarm_worker(void *arg)
+{
+    struct gbm_tudrm_device *dri = arg;
+
+    /* Only use otherwise idle CPU time */
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    pthread_mutex_lock(&dri->lock);
+    for (;;) {
+        struct gbm_tudrm_alloc_key key;
+        struct gbm_tudrm_bo *bo;
+
+        while (!dri->prewarm_pending && !dri->prewarm_quit)
+            pthread_cond_wait(&dri->prewarm_cond, &dri->lock);
+        if (dri->prewarm_quit)
+            break;
+        key = dri->prewarm_key;
+        dri->prewarm_pending--;
+        pthread_mutex_unlock(&dri->lock);
+
+        bo = gbm_tudrm_bo_alloc(dri, &key);
+        if (bo) {
+            bo->data.prewarmed = true;
+            gbm_tudrm_recycle_put(dri, bo);
+        }
+
+        pthread_mutex_lock(&dri->lock);
+        if (bo)
+            dri->stats.prewarmed++;
+    }
+    pthread_mutex_unlock(&dri->lock);
+
+    return NULL;
+}
+
+static bool
+alloc_key_equal(const struct gbm_tudrm_alloc_key *a,
+                const struct gbm_tudrm_alloc_key *b)
+{
+    return a->width == b->width && a->height == b->height &&
+        a->format == b->format && a->usage == b->usage &&
+        a->modifier == b->modifier && a->layout == b->layout;
+}
+
+/* Whether a bo created with usage can have been a buffer of a surface with
+ * flags. Cursor, CPU-written and front rendering bos never are, and the
+ * scanout and linear bits have to agree. */
+static bool
+usage_fits_surface(uint32_t usage, uint32_t flags)
+{
+    const uint32_t layout_bits = GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR;
+
+    if (usage & (GBM_BO_USE_CURSOR | GBM_BO_USE_WRITE | GBM_BO_USE_FRONT_RENDERING))
+        return false;
+    return (usage & layout_bits) == (flags & layout_bits);
+}
+
+/* A surface of a new size usually means a hotplug or mode change, and its
+ * buffers will look like the ones recently allocated for the same format
+ * and usage. Queue as many of those as the last swapchain had. */
+static void
+gbm_tudrm_prewarm_surface(struct gbm_tudrm_device *dri, uint32_t width,
+                          uint32_t height, uint32_t format, uint32_t flags)
+{
+    const struct gbm_tudrm_alloc_key *last = NULL;
+    unsigned count = 0;
+
+    if (!dri->prewarm)
+        return;
+
+    pthread_mutex_lock(&dri->lock);
+    for (unsigned i = 1; i <= dri->history_count; i++) {
+        const struct gbm_tudrm_alloc_key *key =
+            &dri->history[(dri->history_next + ALLOC_HISTORY_MAX - i) % ALLOC_HISTORY_MAX];
+        if (last == NULL && key->format == format &&
+            usage_fits_surface(key->usage, flags))
+            last = key;
+        if (last && alloc_key_equal(key, last))
+            count++;
+    }
+
+    if (last == NULL || (last->width == width && last->height == height)) {
+        pthread_mutex_unlock(&dri->lock);
+        return;
+    }
+
+    dri->prewarm_key = *last;
+    dri->prewarm_key.width = width;
+    dri->prewarm_key.height = height;
+    dri->prewarm_pending = count < RECYCLE_POOL_MAX / 2 ? count : RECYCLE_POOL_MAX / 2;
+
+    if (!dri->prewarm_running) {
+        if (pthread_create(&dri->prewarm_thread, NULL,
+                           gbm_tudrm_prewarm_worker, dri) != 0) {
+            dri->prewarm_pending = 0;
+            pthread_mutex_unlock(&dri->lock);
+            return;
+        }
+        dri->prewarm_running = true;
+    }
+    pthread_cond_signal(&dri->prewarm_cond);
+    pthread_mutex_unlock(&dri->lock);
+}
+
+/* Take a mapped pitch-linear surface matching surf from the staging pool,
+ * allocating one if there is none. */
+static NvBufSurface *
+gbm_tudrm_staging_get(struct gbm_tudrm_device *dri, NvBufSurface *surf)
+{
+    NvBufSurfaceParams *params = &surf->surfaceList[0];
+    NvBufSurfaceAllocateParams args;
+    NvBufSurface *staging = NULL;
+    int ret;
+
+    pthread_mutex_lock(&dri->lock);
+    for (unsigned i = 0; i < dri->staging_count; i++) {
+        NvBufSurfaceParams *p = &dri->staging[i]->surfaceList[0];
+        if (p->width == params->width && p->height == params->height &&
+            p->colorFormat == params->colorFormat) {
+            staging = dri->staging[i];
+            dri->staging[i] = dri->staging[--dri->staging_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dri->lock);
+
+    if (staging)
+        return staging;
+
+    memset(&args, 0, sizeof(args));
+    args.params.width = params->width;
+    args.params.height = params->height;
+    args.params.memType = NVBUF_MEM_SURFACE_ARRAY;
+    args.params.layout = NVBUF_LAYOUT_PITCH;
+    args.params.colorFormat = params->colorFormat;
+
+    TRACE_BEGIN("NvBufSurfaceAllocate %ux%u staging", params->width, params->height);
+    ret = nvbuf.NvBufSurfaceAllocate(&staging, 1, &args);
+    TRACE_END();
+    if (ret < 0)
+        return NULL;
+
+    if (gbm_tudrm_surface_map(staging, NVBUF_MAP_READ_WRITE) < 0) {
+        nvbuf.NvBufSurfaceDestroy(staging);
+        return NULL;
+    }
+
+    return staging;
+}
+
+static void
+gbm_tudrm_staging_free(NvBufSurface *staging)
+{
+    gbm_tudrm_surface_unmap(staging);
+    nvbuf.NvBufSurfaceDestroy(staging);
+}
+
+/* Return a staging surface to the pool, evicting the oldest one if full */
+static void
+gbm_tudrm_staging_put(struct gbm_tudrm_device *dri, NvBufSurface *staging)
+{
+    NvBufSurface *evicted = NULL;
+
+    pthread_mutex_lock(&dri->lock);
+    if (dri->staging_count == STAGING_POOL_MAX) {
+        evicted = dri->staging[0];
+        memmove(&dri->staging[0], &dri->staging[1],
+                (STAGING_POOL_MAX - 1) * sizeof(dri->staging[0]));
+        dri->staging_count--;
+    }
+    dri->staging[dri->staging_count++] = staging;
+    pthread_mutex_unlock(&dri->lock);
+
+    if (evicted)
+        gbm_tudrm_staging_free(evicted);
+}
+
+/* Convert the mapped region between layouts, e.g. detile or retile it */
+static int
+gbm_tudrm_copy_region(NvBufSurface *src, NvBufSurface *dst,
+                      const struct gbm_tudrm_map *map)
+{
+    NvBufSurfTransformRect rect = {
+        .top = map->y,
+        .left = map->x,
+        .width = map->width,
+        .height = map->height,
+    };
+    NvBufSurfTransformParams params;
+    NvBufSurfTransform_Error err;
+
+    memset(&params, 0, sizeof(params));
+    params.transform_flag = NVBUFSURF_TRANSFORM_CROP_SRC | NVBUFSURF_TRANSFORM_CROP_DST;
+    params.transform_filter = NvBufSurfTransformInter_Nearest;
+    params.src_rect = &rect;
+    params.dst_rect = &rect;
+
+    TRACE_BEGIN("NvBufSurfTransform %ux%u+%u+%u", map->width, map->height, map->x, map->y);
+    err = nvbuf.NvBufSurfTransform(src, dst, &params);
+    TRACE_END();
+    if (err != NvBufSurfTransformError_Success) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
 }
 
 static void *
@@ -377,43 +1163,118 @@ gbm_tudrm_bo_map(struct gbm_bo *_bo,
               uint32_t width, uint32_t height,
               uint32_t flags, uint32_t *stride, void **map_data)
 {
+    struct gbm_tudrm_device *dri = gbm_tudrm_device(_bo->gbm);
     struct gbm_tudrm_bo *bo = gbm_tudrm_bo(_bo);
+    struct gbm_tudrm_map *map;
+    uint8_t *base;
+    uint32_t pitch;
 
-    /* If it's a dumb buffer, we already have a mapping */
-    if (bo->data.map) {
-        *map_data = (char *)bo->data.map + (bo->base.v0.stride * y) + (x * 4);
-        *stride = bo->base.v0.stride;
-        return *map_data;
+    if (x >= bo->base.v0.width || y >= bo->base.v0.height ||
+        !(flags & GBM_BO_TRANSFER_READ_WRITE)) {
+        errno = EINVAL;
+        return NULL;
     }
 
-    if (bo->data.surface) {
+    map = calloc(1, sizeof *map);
+    if (map == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* clip the region to the bo */
+    if (width > bo->base.v0.width - x)
+        width = bo->base.v0.width - x;
+    if (height > bo->base.v0.height - y)
+        height = bo->base.v0.height - y;
+
+    map->x = x;
+    map->y = y;
+    map->width = width;
+    map->height = height;
+    map->flags = flags;
+
+    if (bo->data.map) {
+        /* If it's a dumb or dma-heap buffer, we already have a mapping */
+        if (bo->data.heap &&
+            gbm_tudrm_dmabuf_sync(bo->data.dmabuf_fd, DMA_BUF_SYNC_START |
+                                  gbm_tudrm_dmabuf_sync_flags(flags)) < 0)
+            goto fail;
+        base = bo->data.map;
+        pitch = bo->base.v0.stride;
+    } else if (bo->data.surface &&
+               bo->data.surface->surfaceList[0].layout == NVBUF_LAYOUT_BLOCK_LINEAR) {
+        /* Tiled memory isn't usable by the CPU, hand out a linear copy of
+         * just the mapped region instead. The region is detiled for write
+         * maps too: the whole region is retiled on unmap, and pixels the
+         * CPU doesn't touch must not come from whatever the pooled staging
+         * surface held before. */
+        map->staging = gbm_tudrm_staging_get(dri, bo->data.surface);
+        if (map->staging == NULL)
+            goto fail;
+
+        if (gbm_tudrm_copy_region(bo->data.surface, map->staging, map) < 0 ||
+            nvbuf.NvBufSurfaceSyncForCpu(map->staging, 0, 0) < 0)
+            goto fail;
+
+        base = map->staging->surfaceList[0].mappedAddr.addr[0];
+        pitch = map->staging->surfaceList[0].planeParams.pitch[0];
+    } else if (bo->data.surface) {
         NvBufSurface *surf = bo->data.surface;
-        int pitch = surf->surfaceList->planeParams.pitch[0];
-        NvBufSurfaceMap(surf, 0, 0, NVBUF_MAP_READ_WRITE);
-        *map_data = surf->surfaceList->mappedAddr.addr + (pitch * y) + (x * 4);
-        *stride = pitch;
-        return *map_data;
+
+        /* The mapping itself is kept until the bo is destroyed, only the
+         * cache maintenance is done per map/unmap. */
+        if (!surf->surfaceList[0].mappedAddr.addr[0] &&
+            gbm_tudrm_surface_map(surf, NVBUF_MAP_READ_WRITE) < 0)
+            goto fail;
+
+        /* Only invalidate if the CPU is going to look at the contents */
+        if ((flags & GBM_BO_TRANSFER_READ) &&
+            nvbuf.NvBufSurfaceSyncForCpu(surf, 0, 0) < 0)
+            goto fail;
+
+        base = surf->surfaceList[0].mappedAddr.addr[0];
+        pitch = surf->surfaceList[0].planeParams.pitch[0];
+    } else {
+        errno = EINVAL;
+        goto fail;
     }
 
+    *map_data = map;
+    *stride = pitch;
+    return base + ((size_t)pitch * y) + (x * 4);
+
+fail:
+    if (map->staging)
+        gbm_tudrm_staging_put(dri, map->staging);
+    free(map);
     return NULL;
 }
 
 static void
 gbm_tudrm_bo_unmap(struct gbm_bo *_bo, void *map_data)
 {
+    struct gbm_tudrm_device *dri = gbm_tudrm_device(_bo->gbm);
     struct gbm_tudrm_bo *bo = gbm_tudrm_bo(_bo);
-
-    /* Check if it's a dumb buffer and check the pointer is in range */
-    if (bo->data.map) {
-        assert(map_data >= bo->data.map);
-        assert(map_data < (bo->data.map + bo->data.size));
-        return;
+    struct gbm_tudrm_map *map = map_data;
+
+    if (bo->data.heap) {
+        gbm_tudrm_dmabuf_sync(bo->data.dmabuf_fd, DMA_BUF_SYNC_END |
+                              gbm_tudrm_dmabuf_sync_flags(map->flags));
+    } else if (map->staging) {
+        /* Retile only the region the CPU may have written */
+        if (map->flags & GBM_BO_TRANSFER_WRITE) {
+            nvbuf.NvBufSurfaceSyncForDevice(map->staging, 0, 0);
+            gbm_tudrm_copy_region(map->staging, bo->data.surface, map);
+        }
+        gbm_tudrm_staging_put(dri, map->staging);
+    } else if (bo->data.surface && !bo->data.map &&
+               (map->flags & GBM_BO_TRANSFER_WRITE)) {
+        /* Only flush if the CPU may have written to the region. Dumb
+         * buffers are mapped write-combined and don't need any maintenance. */
+        nvbuf.NvBufSurfaceSyncForDevice(bo->data.surface, 0, 0);
     }
 
-    if (bo->data.surface) {
-        NvBufSurfaceUnMap(bo->data.surface, 0, 0);
-        return;
-    }
+    free(map);
 }
 
 static void
@@ -460,10 +1321,16 @@ gbm_tudrm_surface_create(struct gbm_device *gbm,
         assert(!count);
         // if the buffer is being used for scanout, make sure it's linear
         if (flags & GBM_BO_USE_SCANOUT) {
-            surf->base.v0.modifiers = calloc(count, sizeof(uint64_t));
+            surf->base.v0.modifiers = calloc(1, sizeof(uint64_t));
+            if (!surf->base.v0.modifiers) {
+                errno = ENOMEM;
+                free(surf);
+                return NULL;
+            }
             surf->base.v0.modifiers[0] = DRM_FORMAT_MOD_LINEAR;
             surf->base.v0.count = 1;
         }
+        gbm_tudrm_prewarm_surface(dri, width, height, surf->base.v0.format, flags);
         return &surf->base;
     }
 
@@ -474,15 +1341,27 @@ gbm_tudrm_surface_create(struct gbm_device *gbm,
         return NULL;
     }
 
+    /* Since version 1 flags are valid alongside modifiers, so a scanout
+     * surface can be kept linear here as well if the list allows it */
+    bool linear_only = false;
+    if (dri->base.v0.backend_version >= 1 &&
+        (flags & (GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR | GBM_BO_USE_FRONT_RENDERING))) {
+        for (unsigned i = 0; i < count; i++)
+            linear_only |= modifiers[i] == DRM_FORMAT_MOD_LINEAR;
+    }
+
     uint64_t *v0_modifiers = surf->base.v0.modifiers;
-    for (int i = 0; i < count; i++) {
+    for (unsigned i = 0; i < count; i++) {
         // compressed buffers don't render correctly when imported
         if (modifiers[i] & ~DRM_FORMAT_MOD_NVIDIA_BLOCK_LINEAR_2D(0x0, 0x1, 0x3, 0xff, 0xf))
             continue;
+        if (linear_only && modifiers[i] != DRM_FORMAT_MOD_LINEAR)
+            continue;
         *v0_modifiers++ = modifiers[i];
     }
     surf->base.v0.count = v0_modifiers - surf->base.v0.modifiers;
 
+    gbm_tudrm_prewarm_surface(dri, width, height, surf->base.v0.format, flags);
     return &surf->base;
 }
 
@@ -490,6 +1369,48 @@ static void
 gbm_tudrm_device_destroy(struct gbm_device *gbm)
 {
     struct gbm_tudrm_device *tudrm = gbm_tudrm_device(gbm);
+
+    if (tudrm->prewarm_running) {
+        pthread_mutex_lock(&tudrm->lock);
+        tudrm->prewarm_quit = true;
+        pthread_cond_signal(&tudrm->prewarm_cond);
+        pthread_mutex_unlock(&tudrm->lock);
+        pthread_join(tudrm->prewarm_thread, NULL);
+    }
+    pthread_cond_destroy(&tudrm->prewarm_cond);
+
+    /* Let the readback worker finish the queue */
+    if (tudrm->readback_running) {
+        pthread_mutex_lock(&tudrm->lock);
+        tudrm->readback_quit = true;
+        pthread_cond_signal(&tudrm->readback_cond);
+        pthread_mutex_unlock(&tudrm->lock);
+        pthread_join(tudrm->readback_thread, NULL);
+    }
+    pthread_cond_destroy(&tudrm->readback_cond);
+    pthread_cond_destroy(&tudrm->readback_notify_cond);
+
+    /* Readbacks the client still holds can only be destroyed from now on */
+    for (struct gbm_tudrm_readback *rb = tudrm->readbacks; rb; rb = rb->live_next) {
+        if (rb->region.staging)
+            gbm_tudrm_staging_free(rb->region.staging);
+        rb->region.staging = NULL;
+        rb->dri = NULL;
+    }
+
+    for (unsigned i = 0; i < tudrm->recycle_count; i++)
+        gbm_tudrm_bo_release(tudrm, tudrm->recycle[i]);
+    for (unsigned i = 0; i < tudrm->staging_count; i++)
+        gbm_tudrm_staging_free(tudrm->staging[i]);
+    for (unsigned i = 0; i < tudrm->handle_count; i++) {
+        gbm_tudrm_fb_free_list(tudrm, tudrm->handles[i].fbs);
+        if (tudrm->handles[i].fd >= 0)
+            close(tudrm->handles[i].fd);
+    }
+    free(tudrm->handles);
+    if (tudrm->heap_fd >= 0)
+        close(tudrm->heap_fd);
+    pthread_mutex_destroy(&tudrm->lock);
     free(tudrm);
 }
 
@@ -498,7 +1419,9 @@ gbm_tudrm_device_create(int fd, uint32_t gbm_backend_version)
 {
     struct gbm_tudrm_device *tudrm;
 
-    if (gbm_backend_version != GBM_BACKEND_ABI_VERSION) {
+    /* The loader already clamps this to MIN(its version, ours), older
+     * versions are handled where their semantics differ. */
+    if (gbm_backend_version > GBM_BACKEND_ABI_VERSION) {
         errno = EINVAL;
         return NULL;
     }
@@ -509,7 +1432,23 @@ gbm_tudrm_device_create(int fd, uint32_t gbm_backend_version)
         return NULL;
     }
 
-    tudrm->base.v0.backend_version = GBM_BACKEND_ABI_VERSION;
+    gbm_tudrm_trace_init();
+
+    pthread_mutex_init(&tudrm->lock, NULL);
+    pthread_cond_init(&tudrm->readback_cond, NULL);
+    pthread_cond_init(&tudrm->readback_notify_cond, NULL);
+    pthread_cond_init(&tudrm->prewarm_cond, NULL);
+    tudrm->heap_fd = -1;
+
+    /* Populate dumb buffer mappings up front */
+    const char *prefault = getenv("TEGRA_UDRM_GBM_PREFAULT");
+    tudrm->prefault = prefault && strcmp(prefault, "0") != 0;
+
+    /* Pre-allocate buffers for new surfaces */
+    const char *prewarm = getenv("TEGRA_UDRM_GBM_PREWARM");
+    tudrm->prewarm = prewarm && strcmp(prewarm, "0") != 0;
+
+    tudrm->base.v0.backend_version = gbm_backend_version;
     tudrm->base.v0.name = "nvidia";
     tudrm->base.v0.fd = fd;
     tudrm->base.v0.destroy = gbm_tudrm_device_destroy;
@@ -523,6 +1462,7 @@ gbm_tudrm_device_create(int fd, uint32_t gbm_backend_version)
     tudrm->base.v0.bo_write = gbm_tudrm_bo_write;
     tudrm->base.v0.bo_get_fd = gbm_tudrm_bo_get_fd;
     tudrm->base.v0.bo_get_planes = gbm_tudrm_bo_get_planes;
+    tudrm->base.v0.bo_get_plane_fd = gbm_tudrm_bo_get_plane_fd;
     tudrm->base.v0.bo_get_handle = gbm_tudrm_bo_get_handle_for_plane;
     tudrm->base.v0.bo_get_stride = gbm_tudrm_bo_get_stride;
     tudrm->base.v0.bo_get_offset = gbm_tudrm_bo_get_offset;
@@ -532,7 +1472,6 @@ gbm_tudrm_device_create(int fd, uint32_t gbm_backend_version)
 
     /*
 
-   dri->base.v0.bo_get_plane_fd = gbm_dri_bo_get_plane_fd;
    dri->base.v0.bo_get_stride = gbm_dri_bo_get_stride;
    dri->base.v0.bo_get_offset = gbm_dri_bo_get_offset;
    dri->base.v0.bo_get_modifier = gbm_dri_bo_get_modifier;
@@ -546,6 +1485,536 @@ gbm_tudrm_device_create(int fd, uint32_t gbm_backend_version)
     return &tudrm->base;
 }
 
+static bool
+gbm_tudrm_is_device(struct gbm_device *gbm)
+{
+    return gbm && gbm->v0.destroy == gbm_tudrm_device_destroy;
+}
+
+static struct gbm_tudrm_bo *
+gbm_tudrm_shm_bo(struct gbm_bo *_bo)
+{
+    if (!_bo || !gbm_tudrm_is_device(_bo->gbm) || !gbm_tudrm_bo(_bo)->data.shm) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return gbm_tudrm_bo(_bo);
+}
+
+GBM_EXPORT struct gbm_bo *
+gbm_tudrm_bo_import_shm(struct gbm_device *gbm, uint32_t width,
+                        uint32_t height, uint32_t format)
+{
+    struct gbm_tudrm_device *dri = gbm_tudrm_device(gbm);
+    struct gbm_tudrm_bo *bo;
+    struct gbm_tudrm_shm *shm;
+
+    /* No format_canonicalize() here, wl_shm's 0 and 1 mean the opposite */
+    if (!gbm_tudrm_is_device(gbm) ||
+        !gbm_tudrm_is_format_supported(gbm, format, 0) ||
+        width == 0 || height == 0 || width > INT32_MAX / 4 ||
+        height > INT32_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    bo = calloc(1, sizeof *bo);
+    shm = calloc(1, sizeof *shm);
+    if (bo == NULL || shm == NULL) {
+        free(bo);
+        free(shm);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    shm->x1 = 0;
+    shm->y1 = 0;
+    shm->x2 = width;
+    shm->y2 = height;
+
+    bo->base.gbm = gbm;
+    bo->base.v0.width = width;
+    bo->base.v0.height = height;
+    bo->base.v0.format = format;
+    bo->data.dmabuf_fd = -1;
+    bo->data.modifier = DRM_FORMAT_MOD_LINEAR;
+    bo->data.shm = shm;
+
+    if (gbm_tudrm_bo_alloc_surface(dri, bo, NVBUF_LAYOUT_PITCH, 0) < 0)
+        goto fail;
+
+    /* The device copy stays mapped for the lifetime of the bo */
+    if (gbm_tudrm_surface_map(bo->data.surface, NVBUF_MAP_WRITE) < 0)
+        goto fail;
+
+    return &bo->base;
+
+fail:
+    gbm_tudrm_bo_release(dri, bo);
+    return NULL;
+}
+
+GBM_EXPORT int
+gbm_tudrm_bo_shm_damage(struct gbm_bo *_bo, int32_t x, int32_t y,
+                        int32_t width, int32_t height)
+{
+    struct gbm_tudrm_bo *bo = gbm_tudrm_shm_bo(_bo);
+    struct gbm_tudrm_shm *shm;
+    int32_t x2, y2;
+
+    if (bo == NULL)
+        return -1;
+    shm = bo->data.shm;
+
+    /* clip to the buffer */
+    x2 = (width > 0 && x < INT32_MAX - width) ? x + width : x;
+    y2 = (height > 0 && y < INT32_MAX - height) ? y + height : y;
+    if (x < 0)
+        x = 0;
+    if (y < 0)
+        y = 0;
+    if (x2 > (int32_t)bo->base.v0.width)
+        x2 = bo->base.v0.width;
+    if (y2 > (int32_t)bo->base.v0.height)
+        y2 = bo->base.v0.height;
+    if (x >= x2 || y >= y2)
+        return 0;
+
+    if (shm->x1 >= shm->x2) {
+        shm->x1 = x;
+        shm->y1 = y;
+        shm->x2 = x2;
+        shm->y2 = y2;
+        return 0;
+    }
+
+    if (x < shm->x1)
+        shm->x1 = x;
+    if (y < shm->y1)
+        shm->y1 = y;
+    if (x2 > shm->x2)
+        shm->x2 = x2;
+    if (y2 > shm->y2)
+        shm->y2 = y2;
+    return 0;
+}
+
+GBM_EXPORT int
+gbm_tudrm_bo_shm_upload(struct gbm_bo *_bo, const void *data, uint32_t stride)
+{
+    struct gbm_tudrm_bo *bo = gbm_tudrm_shm_bo(_bo);
+    struct gbm_tudrm_shm *shm;
+    NvBufSurfaceParams *params;
+    uint8_t *dst;
+    uint32_t pitch;
+    size_t len;
+
+    if (bo == NULL)
+        return -1;
+    shm = bo->data.shm;
+
+    if (data == NULL || stride < bo->base.v0.width * 4) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (shm->x1 >= shm->x2)
+        return 0;
+
+    params = &bo->data.surface->surfaceList[0];
+    pitch = params->planeParams.pitch[0];
+    dst = params->mappedAddr.addr[0];
+    len = (size_t)(shm->x2 - shm->x1) * 4;
+
+    for (int32_t y = shm->y1; y < shm->y2; y++) {
+        memcpy(dst + (size_t)pitch * y + shm->x1 * 4,
+               (const uint8_t *)data + (size_t)stride * y + shm->x1 * 4, len);
+    }
+
+    if (nvbuf.NvBufSurfaceSyncForDevice(bo->data.surface, 0, 0) < 0)
+        return -1;
+
+    shm->x1 = shm->x2 = 0;
+    return 0;
+}
+
+/* Find the framebuffer matching bo among those of its handle. Called with
+ * dri->lock held. */
+static struct gbm_tudrm_fb *
+gbm_tudrm_fb_lookup(struct gbm_tudrm_device *dri, struct gbm_tudrm_bo *bo,
+                    struct gbm_tudrm_handle_ref **ref_out)
+{
+    struct gbm_tudrm_handle_ref *ref = NULL;
+
+    for (unsigned i = 0; i < dri->handle_count; i++) {
+        if (dri->handles[i].handle == bo->base.v0.handle.u32) {
+            ref = &dri->handles[i];
+            break;
+        }
+    }
+    *ref_out = ref;
+    if (ref == NULL)
+        return NULL;
+
+    for (struct gbm_tudrm_fb *fb = ref->fbs; fb; fb = fb->next) {
+        if (fb->width == bo->base.v0.width &&
+            fb->height == bo->base.v0.height &&
+            fb->format == bo->base.v0.format &&
+            fb->stride == bo->base.v0.stride &&
+            fb->modifier == bo->data.modifier)
+            return fb;
+    }
+    return NULL;
+}
+
+GBM_EXPORT uint32_t
+gbm_tudrm_bo_get_fb_id(struct gbm_bo *_bo)
+{
+    struct gbm_tudrm_device *dri;
+    struct gbm_tudrm_bo *bo;
+    struct gbm_tudrm_handle_ref *ref;
+    struct gbm_tudrm_fb *fb;
+    uint32_t handles[4] = { 0 }, strides[4] = { 0 }, offsets[4] = { 0 };
+    uint64_t modifiers[4] = { 0 };
+    uint32_t flags = 0;
+    uint32_t fb_id;
+
+    if (!_bo || !gbm_tudrm_is_device(_bo->gbm)) {
+        errno = EINVAL;
+        return 0;
+    }
+    dri = gbm_tudrm_device(_bo->gbm);
+    bo = gbm_tudrm_bo(_bo);
+
+    if (gbm_tudrm_bo_ensure_handle(dri, bo) < 0)
+        return 0;
+
+    pthread_mutex_lock(&dri->lock);
+    fb = gbm_tudrm_fb_lookup(dri, bo, &ref);
+    fb_id = fb ? fb->fb_id : 0;
+    pthread_mutex_unlock(&dri->lock);
+    if (fb_id)
+        return fb_id;
+
+    handles[0] = bo->base.v0.handle.u32;
+    strides[0] = bo->base.v0.stride;
+    if (bo->data.modifier != DRM_FORMAT_MOD_INVALID) {
+        modifiers[0] = bo->data.modifier;
+        flags |= DRM_MODE_FB_MODIFIERS;
+    }
+
+    if (drmModeAddFB2WithModifiers(dri->base.v0.fd,
+                                   bo->base.v0.width, bo->base.v0.height,
+                                   bo->base.v0.format, handles, strides,
+                                   offsets, modifiers, &fb_id, flags) < 0)
+        return 0;
+
+    pthread_mutex_lock(&dri->lock);
+    fb = gbm_tudrm_fb_lookup(dri, bo, &ref);
+    if (fb || ref == NULL || (fb = calloc(1, sizeof *fb)) == NULL) {
+        /* another thread added the same one meanwhile, or out of memory */
+        uint32_t found = fb ? fb->fb_id : 0;
+        pthread_mutex_unlock(&dri->lock);
+        drmModeRmFB(dri->base.v0.fd, fb_id);
+        if (!found)
+            errno = ENOMEM;
+        return found;
+    }
+    fb->fb_id = fb_id;
+    fb->width = bo->base.v0.width;
+    fb->height = bo->base.v0.height;
+    fb->format = bo->base.v0.format;
+    fb->stride = bo->base.v0.stride;
+    fb->modifier = bo->data.modifier;
+    fb->next = ref->fbs;
+    ref->fbs = fb;
+    pthread_mutex_unlock(&dri->lock);
+
+    return fb_id;
+}
+
+static void
+gbm_tudrm_readback_free(struct gbm_tudrm_readback *rb)
+{
+    struct gbm_tudrm_device *dri = rb->dri;
+
+    if (dri) {
+        pthread_mutex_lock(&dri->lock);
+        for (struct gbm_tudrm_readback **p = &dri->readbacks; *p; p = &(*p)->live_next) {
+            if (*p == rb) {
+                *p = rb->live_next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&dri->lock);
+        if (rb->region.staging)
+            gbm_tudrm_staging_put(dri, rb->region.staging);
+    }
+    free(rb->buffer);
+    free(rb);
+}
+
+static int
+gbm_tudrm_readback_run(struct gbm_tudrm_readback *rb)
+{
+    struct gbm_tudrm_bo *bo = rb->bo;
+    struct gbm_tudrm_map *region = &rb->region;
+
+    if (bo->data.map) {
+        const uint8_t *src = bo->data.map;
+        uint8_t *dst;
+
+        rb->stride = region->width * 4;
+        rb->buffer = malloc((size_t)rb->stride * region->height);
+        if (rb->buffer == NULL)
+            return -ENOMEM;
+
+        if (bo->data.heap)
+            gbm_tudrm_dmabuf_sync(bo->data.dmabuf_fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+        dst = rb->buffer;
+        src += (size_t)bo->base.v0.stride * region->y + region->x * 4;
+        for (uint32_t y = 0; y < region->height; y++) {
+            memcpy(dst, src, rb->stride);
+            dst += rb->stride;
+            src += bo->base.v0.stride;
+        }
+        if (bo->data.heap)
+            gbm_tudrm_dmabuf_sync(bo->data.dmabuf_fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+        return 0;
+    }
+
+    if (bo->data.surface) {
+        region->staging = gbm_tudrm_staging_get(rb->dri, bo->data.surface);
+        if (region->staging == NULL)
+            return -ENOMEM;
+        if (gbm_tudrm_copy_region(bo->data.surface, region->staging, region) < 0 ||
+            nvbuf.NvBufSurfaceSyncForCpu(region->staging, 0, 0) < 0)
+            return -EIO;
+        rb->stride = region->staging->surfaceList[0].planeParams.pitch[0];
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+static void *
+gbm_tudrm_readback_worker(void *arg)
+{
+    struct gbm_tudrm_device *dri = arg;
+
+    pthread_mutex_lock(&dri->lock);
+    for (;;) {
+        struct gbm_tudrm_readback *rb;
+        bool abandoned;
+        int status;
+
+        while (!dri->readback_head && !dri->readback_quit)
+            pthread_cond_wait(&dri->readback_cond, &dri->lock);
+        rb = dri->readback_head;
+        if (rb == NULL)
+            break;
+        dri->readback_head = rb->next;
+        if (dri->readback_head == NULL)
+            dri->readback_tail = NULL;
+        abandoned = rb->abandoned;
+        rb->running = !abandoned;
+        pthread_mutex_unlock(&dri->lock);
+
+        status = abandoned ? -ECANCELED : gbm_tudrm_readback_run(rb);
+
+        /* While running or notifying, gbm_tudrm_readback_destroy() waits
+         * for us instead of returning, so the bo, the callback and the
+         * eventfd stay valid */
+        pthread_mutex_lock(&dri->lock);
+        rb->status = status;
+        rb->done = true;
+        rb->running = false;
+        abandoned = rb->abandoned;
+        rb->notifying = !abandoned;
+        if (abandoned)
+            pthread_cond_broadcast(&dri->readback_notify_cond);
+        pthread_mutex_unlock(&dri->lock);
+
+        if (!abandoned) {
+            if (rb->callback)
+                rb->callback(rb, rb->callback_data);
+
+            /* the callback may have destroyed it */
+            pthread_mutex_lock(&dri->lock);
+            abandoned = rb->abandoned;
+            pthread_mutex_unlock(&dri->lock);
+
+            if (!abandoned && rb->eventfd >= 0) {
+                uint64_t one = 1;
+                if (write(rb->eventfd, &one, sizeof one) < 0)
+                    fprintf(stderr, "tegra-udrm: readback eventfd: %s\n", strerror(errno));
+            }
+
+            pthread_mutex_lock(&dri->lock);
+            rb->notifying = false;
+            abandoned = rb->abandoned;
+            pthread_cond_broadcast(&dri->readback_notify_cond);
+            pthread_mutex_unlock(&dri->lock);
+        }
+
+        if (abandoned)
+            gbm_tudrm_readback_free(rb);
+
+        pthread_mutex_lock(&dri->lock);
+    }
+    pthread_mutex_unlock(&dri->lock);
+
+    return NULL;
+}
+
+GBM_EXPORT struct gbm_tudrm_readback *
+gbm_tudrm_bo_readback(struct gbm_bo *_bo, uint32_t x, uint32_t y,
+                      uint32_t width, uint32_t height, int eventfd,
+                      gbm_tudrm_readback_func callback, void *data)
+{
+    struct gbm_tudrm_device *dri;
+    struct gbm_tudrm_readback *rb;
+    struct gbm_tudrm_bo *bo;
+
+    if (!_bo || !gbm_tudrm_is_device(_bo->gbm)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    dri = gbm_tudrm_device(_bo->gbm);
+    bo = gbm_tudrm_bo(_bo);
+
+    if (x >= bo->base.v0.width || y >= bo->base.v0.height ||
+        width == 0 || height == 0 ||
+        (!bo->data.map && !bo->data.surface)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    rb = calloc(1, sizeof *rb);
+    if (rb == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* clip the region to the bo */
+    if (width > bo->base.v0.width - x)
+        width = bo->base.v0.width - x;
+    if (height > bo->base.v0.height - y)
+        height = bo->base.v0.height - y;
+
+    rb->dri = dri;
+    rb->bo = bo;
+    rb->region.x = x;
+    rb->region.y = y;
+    rb->region.width = width;
+    rb->region.height = height;
+    rb->region.flags = GBM_BO_TRANSFER_READ;
+    rb->eventfd = eventfd;
+    rb->callback = callback;
+    rb->callback_data = data;
+
+    pthread_mutex_lock(&dri->lock);
+    if (!dri->readback_running) {
+        if (pthread_create(&dri->readback_thread, NULL,
+                           gbm_tudrm_readback_worker, dri) != 0) {
+            pthread_mutex_unlock(&dri->lock);
+            free(rb);
+            errno = EAGAIN;
+            return NULL;
+        }
+        dri->readback_running = true;
+    }
+    if (dri->readback_tail)
+        dri->readback_tail->next = rb;
+    else
+        dri->readback_head = rb;
+    dri->readback_tail = rb;
+    rb->live_next = dri->readbacks;
+    dri->readbacks = rb;
+    pthread_cond_signal(&dri->readback_cond);
+    pthread_mutex_unlock(&dri->lock);
+
+    return rb;
+}
+
+GBM_EXPORT const void *
+gbm_tudrm_readback_map(struct gbm_tudrm_readback *rb, uint32_t *stride)
+{
+    int status;
+    bool done;
+
+    if (rb->dri == NULL) {
+        errno = ENODEV;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&rb->dri->lock);
+    done = rb->done;
+    status = rb->status;
+    pthread_mutex_unlock(&rb->dri->lock);
+
+    if (!done) {
+        errno = EBUSY;
+        return NULL;
+    }
+    if (status < 0) {
+        errno = -status;
+        return NULL;
+    }
+
+    *stride = rb->stride;
+    if (rb->buffer)
+        return rb->buffer;
+    return (const uint8_t *)rb->region.staging->surfaceList[0].mappedAddr.addr[0] +
+        (size_t)rb->stride * rb->region.y + rb->region.x * 4;
+}
+
+GBM_EXPORT void
+gbm_tudrm_readback_destroy(struct gbm_tudrm_readback *rb)
+{
+    struct gbm_tudrm_device *dri = rb->dri;
+    bool idle;
+
+    if (dri == NULL) {
+        gbm_tudrm_readback_free(rb);
+        return;
+    }
+
+    pthread_mutex_lock(&dri->lock);
+    idle = rb->done && !rb->notifying;
+    rb->abandoned = true;
+    /* Don't return while the bo, the callback or the eventfd may still be
+     * used, unless called from the callback itself */
+    if ((rb->running || rb->notifying) &&
+        !pthread_equal(pthread_self(), dri->readback_thread)) {
+        while (rb->running || rb->notifying)
+            pthread_cond_wait(&dri->readback_notify_cond, &dri->lock);
+    }
+    pthread_mutex_unlock(&dri->lock);
+
+    /* otherwise the worker frees it once it's done with it */
+    if (idle)
+        gbm_tudrm_readback_free(rb);
+}
+
+GBM_EXPORT int
+gbm_tudrm_device_get_pool_stats(struct gbm_device *gbm,
+                                struct gbm_tudrm_pool_stats *stats)
+{
+    struct gbm_tudrm_device *dri;
+
+    if (!gbm_tudrm_is_device(gbm) || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    dri = gbm_tudrm_device(gbm);
+
+    pthread_mutex_lock(&dri->lock);
+    *stats = dri->stats;
+    pthread_mutex_unlock(&dri->lock);
+    return 0;
+}
+
 struct gbm_backend gbm_backend = {
     .v0.backend_version = GBM_BACKEND_ABI_VERSION,
     .v0.backend_name = "tegra-udrm",
@@ -0,0 +1,154 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _GBM_TUDRM_H_
+#define _GBM_TUDRM_H_
+
+/*
+ * Backend extensions for tegra-udrm.
+ *
+ * These entry points are exported from the backend module itself, not from
+ * libgbm. Clients resolve them with dlsym() on the backend (for example
+ * dlopen("tegra-udrm_gbm.so", RTLD_NOLOAD | RTLD_LAZY)). Every function
+ * checks that the device or bo it is given belongs to this backend and fails
+ * with EINVAL otherwise.
+ */
+
+#include <stdint.h>
+#include <gbm.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Create a bo for a shared-memory (e.g. wl_shm) buffer.
+ *
+ * Only a pitch-linear device copy is allocated. The returned bo exports that
+ * copy through the usual handle/fd/stride queries, and the client memory is
+ * only read by gbm_tudrm_bo_shm_upload(). The whole buffer starts out
+ * damaged.
+ *
+ * format is a GBM/DRM fourcc such as GBM_FORMAT_ARGB8888. The wl_shm enum
+ * values 0 and 1 (WL_SHM_FORMAT_ARGB8888/XRGB8888) must be translated by the
+ * caller; they are rejected rather than taken as the legacy
+ * GBM_BO_FORMAT_XRGB8888/ARGB8888, which have the opposite meaning.
+ */
+struct gbm_bo *
+gbm_tudrm_bo_import_shm(struct gbm_device *gbm, uint32_t width,
+                        uint32_t height, uint32_t format);
+
+/*
+ * Mark a rectangle of a shm bo as changed by the client. Damage accumulates
+ * until the next gbm_tudrm_bo_shm_upload().
+ */
+int
+gbm_tudrm_bo_shm_damage(struct gbm_bo *bo, int32_t x, int32_t y,
+                        int32_t width, int32_t height);
+
+/*
+ * Copy the accumulated damage from the client's pixels into the device copy.
+ * Does nothing if there is no pending damage, so it's cheap to call on every
+ * frame.
+ *
+ * data points at the first pixel of the buffer and is only read during the
+ * call. A client can truncate its pool at any time, so the caller must read
+ * it under its own SIGBUS protection, e.g. between
+ * wl_shm_buffer_begin_access() and wl_shm_buffer_end_access() with the
+ * pointer from wl_shm_buffer_get_data().
+ */
+int
+gbm_tudrm_bo_shm_upload(struct gbm_bo *bo, const void *data, uint32_t stride);
+
+/*
+ * Return a KMS framebuffer for bo, created with drmModeAddFB2WithModifiers()
+ * on the device fd the first time. It is cached with the GEM handle, so
+ * importing the same dma-buf again with the same size, format, stride and
+ * modifier returns the same framebuffer. The framebuffer is removed once
+ * the last bo using the handle is released, so callers must not
+ * drmModeRmFB() it. Returns 0 on failure with errno set.
+ */
+uint32_t
+gbm_tudrm_bo_get_fb_id(struct gbm_bo *bo);
+
+/*
+ * Asynchronous readback of a region of a bo into a pitch-linear copy.
+ *
+ * The copy is done on a worker thread of the device, by VIC for NvBufSurface
+ * bos, so the caller never blocks on cache maintenance or the copy itself.
+ * On completion the callback (if any) is called from the worker thread and
+ * eventfd (if not -1) is signalled. The bo must stay alive until then, or
+ * until gbm_tudrm_readback_destroy() returns.
+ */
+struct gbm_tudrm_readback;
+
+typedef void (*gbm_tudrm_readback_func)(struct gbm_tudrm_readback *readback,
+                                        void *data);
+
+struct gbm_tudrm_readback *
+gbm_tudrm_bo_readback(struct gbm_bo *bo, uint32_t x, uint32_t y,
+                      uint32_t width, uint32_t height, int eventfd,
+                      gbm_tudrm_readback_func callback, void *data);
+
+/*
+ * Returns the copied region once the readback has completed, NULL with errno
+ * set to EBUSY while it is pending or to the failure reason otherwise.
+ */
+const void *
+gbm_tudrm_readback_map(struct gbm_tudrm_readback *readback, uint32_t *stride);
+
+/*
+ * Release a readback and its staging buffer. May be called while it is still
+ * pending, in which case the result is discarded without notification. If the
+ * worker is copying the region or running the callback, this waits for it to
+ * finish, so neither the bo, the callback nor the eventfd is used after it
+ * returns. It may also be called from the callback itself.
+ *
+ * Readbacks still alive when their device is destroyed can only be destroyed
+ * afterwards, gbm_tudrm_readback_map() then fails with ENODEV.
+ */
+void
+gbm_tudrm_readback_destroy(struct gbm_tudrm_readback *readback);
+
+/*
+ * Statistics of the per-device pool that bo_create is served from. Destroyed
+ * bos are kept in the pool, and bos matching recent allocation patterns are
+ * allocated into it ahead of time when a surface of a new size is created
+ * and TEGRA_UDRM_GBM_PREWARM=1 is set.
+ */
+struct gbm_tudrm_pool_stats {
+    uint64_t hits;         /* bo_create served from the pool */
+    uint64_t misses;       /* bo_create that had to allocate */
+    uint64_t prewarmed;    /* bos allocated ahead of time */
+    uint64_t prewarm_hits; /* prewarmed bos later handed out */
+};
+
+int
+gbm_tudrm_device_get_pool_stats(struct gbm_device *gbm,
+                                struct gbm_tudrm_pool_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,8 +25,12 @@
 #define _GBM_TUDRM_INTERNAL_H_
 
 #include "gbmint.h"
+#include "tegra_udrm_gbm.h"
 #include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include <nvbufsurface.h>
+#include <nvbufsurftransform.h>
 
 #define ALIGN(val, align) (((val) + (align) - 1) & ~((align) - 1))
 
@@ -34,18 +38,168 @@
 
 #define BACK_BUFFERS_MAX 10
 
+#define STAGING_POOL_MAX 4
+
+#define RECYCLE_POOL_MAX 8
+
+#define ALLOC_HISTORY_MAX 16
+
+/* Parameters of a bo_create, as resolved by the backend */
+struct gbm_tudrm_alloc_key {
+    uint32_t width, height, format, usage;
+    uint64_t modifier;
+    NvBufSurfaceLayout layout;
+};
+
+/* A KMS framebuffer added for a GEM handle */
+struct gbm_tudrm_fb {
+    struct gbm_tudrm_fb *next;
+    uint32_t fb_id;
+    uint32_t width, height, format, stride;
+    uint64_t modifier;
+};
+
+/* A reference counted GEM handle, of a dumb buffer or from
+ * drmPrimeFDToHandle, which returns the same handle every time a given
+ * dma-buf is imported, including one exported from a dumb buffer. The
+ * dma-buf fd is exported once on demand and shared by every bo using the
+ * handle, and so are the framebuffers added for it. Both go away with the
+ * last reference. */
+struct gbm_tudrm_handle_ref {
+    uint32_t handle;
+    unsigned refs;
+    int fd;
+    struct gbm_tudrm_fb *fbs;
+};
+
+struct gbm_tudrm_bo;
+struct gbm_tudrm_readback;
+
+/* NvBufSurface entry points, resolved by gbm_tudrm_nvbuf_load(). Every bo
+ * with a surface implies they are loaded. */
+struct gbm_tudrm_nvbuf {
+    __typeof__(NvBufSurfaceAllocate) *NvBufSurfaceAllocate;
+    __typeof__(NvBufSurfaceDestroy) *NvBufSurfaceDestroy;
+    __typeof__(NvBufSurfaceMap) *NvBufSurfaceMap;
+    __typeof__(NvBufSurfaceUnMap) *NvBufSurfaceUnMap;
+    __typeof__(NvBufSurfaceSyncForCpu) *NvBufSurfaceSyncForCpu;
+    __typeof__(NvBufSurfaceSyncForDevice) *NvBufSurfaceSyncForDevice;
+    __typeof__(NvBufSurfTransform) *NvBufSurfTransform;
+};
+
+extern struct gbm_tudrm_nvbuf nvbuf;
+
+bool
+gbm_tudrm_nvbuf_load(void);
+
+#ifdef GBM_TUDRM_TRACE
+/* -1 unless tracing was enabled by gbm_tudrm_trace_init() */
+extern int gbm_tudrm_trace_fd;
+
+void
+gbm_tudrm_trace_init(void);
+
+void
+gbm_tudrm_trace_begin(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+void
+gbm_tudrm_trace_end(void);
+
+#define TRACE_BEGIN(...) do { \
+        if (__builtin_expect(gbm_tudrm_trace_fd >= 0, 0)) \
+            gbm_tudrm_trace_begin(__VA_ARGS__); \
+    } while (0)
+#define TRACE_END() do { \
+        if (__builtin_expect(gbm_tudrm_trace_fd >= 0, 0)) \
+            gbm_tudrm_trace_end(); \
+    } while (0)
+#else
+#define gbm_tudrm_trace_init() do { } while (0)
+#define TRACE_BEGIN(...) do { } while (0)
+#define TRACE_END() do { } while (0)
+#endif
+
+/* Print a fourcc as its four characters */
+#define FOURCC_FMT "%c%c%c%c"
+#define FOURCC_ARGS(f) (char)((f) & 0xff), (char)(((f) >> 8) & 0xff), \
+    (char)(((f) >> 16) & 0xff), (char)(((f) >> 24) & 0xff)
+
 struct gbm_tudrm_device {
    struct gbm_device base;
+   bool prefault;
+   /* dma-heap for CPU-only buffers, -1 if unavailable */
+   int heap_fd;
+   bool heap_probed;
+
+   pthread_mutex_t lock;
+   /* idle pitch-linear surfaces for CPU maps of block-linear bos, kept mapped */
+   NvBufSurface *staging[STAGING_POOL_MAX];
+   unsigned staging_count;
+   /* destroyed bos kept for reuse by bo_create, oldest first */
+   struct gbm_tudrm_bo *recycle[RECYCLE_POOL_MAX];
+   unsigned recycle_count;
+   struct gbm_tudrm_handle_ref *handles;
+   unsigned handle_count, handle_alloc;
+
+   struct gbm_tudrm_pool_stats stats;
+
+   /* recent allocations, used to predict the buffers of new surfaces */
+   struct gbm_tudrm_alloc_key history[ALLOC_HISTORY_MAX];
+   unsigned history_next, history_count;
+
+   /* low priority pre-allocation worker, started on first use */
+   bool prewarm;
+   pthread_t prewarm_thread;
+   pthread_cond_t prewarm_cond;
+   bool prewarm_running, prewarm_quit;
+   struct gbm_tudrm_alloc_key prewarm_key;
+   unsigned prewarm_pending;
+
+   /* asynchronous readback queue and its worker, started on first use */
+   pthread_t readback_thread;
+   pthread_cond_t readback_cond;
+   bool readback_running, readback_quit;
+   struct gbm_tudrm_readback *readback_head, *readback_tail;
+   /* signalled when the worker is done copying or notifying a readback */
+   pthread_cond_t readback_notify_cond;
+   /* every readback not destroyed yet, detached at device destroy */
+   struct gbm_tudrm_readback *readbacks;
+};
+
+/* Upload state of a bo created for shared memory (wl_shm) */
+struct gbm_tudrm_shm {
+    /* pending damage box, empty when x1 >= x2 */
+    int32_t x1, y1, x2, y2;
 };
 
 struct gbm_tudrm_bo_data {
+    /* -1 for imports, which only keep the GEM handle */
     int dmabuf_fd;
     uint64_t modifier;
     /* Used for cursors and the swrast front BO */
     uint32_t handle, size;
     void *map;
+    /* allocated from a dma-heap, dmabuf_fd is owned */
+    bool heap;
     /* for created buffers */
     NvBufSurface *surface;
+    /* for shm imports, uploaded into surface */
+    struct gbm_tudrm_shm *shm;
+    /* usage passed to bo_create, for matching in the recycle pool */
+    uint32_t usage;
+    bool recyclable;
+    /* a dma-buf fd was handed out, so others may still hold the memory */
+    bool exported;
+    /* allocated ahead of time and not handed out yet */
+    bool prewarmed;
+};
+
+/* An outstanding gbm_bo_map() of a rectangle of a bo */
+struct gbm_tudrm_map {
+    uint32_t x, y, width, height;
+    uint32_t flags;
+    /* linear copy of the region for block-linear bos */
+    NvBufSurface *staging;
 };
 
 struct gbm_tudrm_bo {
@@ -53,6 +207,24 @@ struct gbm_tudrm_bo {
     struct gbm_tudrm_bo_data data;
 };
 
+struct gbm_tudrm_readback {
+    struct gbm_tudrm_readback *next, *live_next;
+    /* NULL once the device is destroyed */
+    struct gbm_tudrm_device *dri;
+    struct gbm_tudrm_bo *bo;
+    /* the region, and its staging surface for NvBufSurface bos */
+    struct gbm_tudrm_map region;
+    /* copy of the region for CPU mapped bos */
+    void *buffer;
+    uint32_t stride;
+    int eventfd;
+    void (*callback)(struct gbm_tudrm_readback *readback, void *data);
+    void *callback_data;
+    /* protected by dri->lock */
+    int status;
+    bool done, running, notifying, abandoned;
+};
+
 struct gbm_tudrm_surface {
    void *reserved_for_egl_gbm;
    struct gbm_surface base;
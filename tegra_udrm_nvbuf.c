@@ -0,0 +1,94 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "tegra_udrm_gbm_int.h"
+
+/*
+ * libnvbufsurface and libnvbufsurftransform pull in a large part of the
+ * multimedia stack. Only load them once a bo actually needs an NvBufSurface,
+ * so that opening a device, probing formats or using dumb buffers stays cheap.
+ */
+
+struct gbm_tudrm_nvbuf nvbuf;
+
+static pthread_once_t nvbuf_once = PTHREAD_ONCE_INIT;
+static bool nvbuf_loaded;
+
+static void *
+nvbuf_dlopen(const char *soname, const char *name)
+{
+    void *lib = dlopen(soname, RTLD_LAZY | RTLD_LOCAL);
+    if (lib == NULL)
+        lib = dlopen(name, RTLD_LAZY | RTLD_LOCAL);
+    if (lib == NULL)
+        fprintf(stderr, "tegra-udrm: %s\n", dlerror());
+    return lib;
+}
+
+#define NVBUF_RESOLVE(lib, sym)                                  \
+    do {                                                         \
+        nvbuf.sym = (__typeof__(nvbuf.sym))dlsym(lib, #sym);     \
+        if (nvbuf.sym == NULL) {                                 \
+            fprintf(stderr, "tegra-udrm: %s\n", dlerror());      \
+            return;                                              \
+        }                                                        \
+    } while (0)
+
+static void
+nvbuf_load_once(void)
+{
+    void *surface, *transform;
+
+    surface = nvbuf_dlopen("libnvbufsurface.so.1.0.0", "libnvbufsurface.so");
+    if (surface == NULL)
+        return;
+    transform = nvbuf_dlopen("libnvbufsurftransform.so.1.0.0", "libnvbufsurftransform.so");
+    if (transform == NULL)
+        return;
+
+    NVBUF_RESOLVE(surface, NvBufSurfaceAllocate);
+    NVBUF_RESOLVE(surface, NvBufSurfaceDestroy);
+    NVBUF_RESOLVE(surface, NvBufSurfaceMap);
+    NVBUF_RESOLVE(surface, NvBufSurfaceUnMap);
+    NVBUF_RESOLVE(surface, NvBufSurfaceSyncForCpu);
+    NVBUF_RESOLVE(surface, NvBufSurfaceSyncForDevice);
+    NVBUF_RESOLVE(transform, NvBufSurfTransform);
+
+    /* The libraries stay loaded for the lifetime of the process */
+    nvbuf_loaded = true;
+}
+
+bool
+gbm_tudrm_nvbuf_load(void)
+{
+    pthread_once(&nvbuf_once, nvbuf_load_once);
+    if (!nvbuf_loaded)
+        errno = ENOSYS;
+    return nvbuf_loaded;
+}
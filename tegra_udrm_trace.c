@@ -0,0 +1,95 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "tegra_udrm_gbm_int.h"
+
+/*
+ * Begin/end events written to the ftrace marker in the systrace format
+ * ("B|pid|name" / "E|pid"), which perfetto and trace-cmd both understand, so
+ * allocator and mapping calls show up on the same timeline as the compositor.
+ * Enabled with TEGRA_UDRM_GBM_TRACE=1 when tracefs is writable.
+ */
+
+int gbm_tudrm_trace_fd = -1;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pid_t trace_pid;
+
+static void
+trace_init_once(void)
+{
+    const char *trace = getenv("TEGRA_UDRM_GBM_TRACE");
+
+    if (!trace || strcmp(trace, "0") == 0)
+        return;
+
+    trace_pid = getpid();
+    gbm_tudrm_trace_fd = open("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+    if (gbm_tudrm_trace_fd < 0)
+        gbm_tudrm_trace_fd = open("/sys/kernel/debug/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+    if (gbm_tudrm_trace_fd < 0)
+        fprintf(stderr, "tegra-udrm: can't open trace_marker, tracing disabled\n");
+}
+
+void
+gbm_tudrm_trace_init(void)
+{
+    pthread_once(&trace_once, trace_init_once);
+}
+
+void
+gbm_tudrm_trace_begin(const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    int len;
+
+    len = snprintf(buf, sizeof buf, "B|%d|", trace_pid);
+    va_start(args, fmt);
+    len += vsnprintf(buf + len, sizeof buf - len, fmt, args);
+    va_end(args);
+    if (len >= (int)sizeof buf)
+        len = sizeof buf - 1;
+
+    /* a marker write is atomic, there is nothing to do if it fails */
+    if (write(gbm_tudrm_trace_fd, buf, len) < 0)
+        return;
+}
+
+void
+gbm_tudrm_trace_end(void)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof buf, "E|%d", trace_pid);
+
+    if (write(gbm_tudrm_trace_fd, buf, len) < 0)
+        return;
+}